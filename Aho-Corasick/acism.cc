@@ -1,8 +1,12 @@
 #include "acism.h"
 #include <cstring>
+#include <algorithm>
 
 typedef enum { BASE=2, USED=1 } USES;
 
+// Largest trie acism_create will build from ACISM_PATTERN globs.
+enum { MAX_TRIE_BYTES = 256 << 20 };
+
 // bitwid: 1+floor(log2(u))
 static inline int bitwid(unsigned u)
 {
@@ -22,18 +26,45 @@ typedef struct tnode {
   unsigned    nrefs;
   unsigned    state;
   unsigned    match;
+  unsigned    heat;           // training visits; orders interleave()
   unsigned short    sym;
   char        is_suffix;      // "bool"
 } TNODE;
 
+// ACISM_PATTERN: each pattern parsed into atoms, one per text byte.
+//  An atom below 256 is a literal byte; (256 + i) is the byte class setv[i].
+typedef struct { uint32_t bits[8]; } BYTESET;
+
+typedef struct {
+  unsigned *atomv;          // all patterns' atoms
+  unsigned *startv;         // [nstrs+1] pattern i is atomv[startv[i]..startv[i+1])
+  BYTESET  *setv;           // distinct byte classes
+  unsigned nsets;
+  unsigned short *symsv;    // syms (ascending) class i expands to:
+  unsigned *symp;           //  symsv[symp[i]..symp[i+1])
+} PATTS;
+
+// Patterns that reach an already-matching node, for fill_groups.
+typedef struct { TNODE *node; unsigned strno; } DUP;
+typedef struct { DUP *v; unsigned n, cap; } DUPS;
+
 static void   fill_symv(ACISM*, MEMREF const*, int ns);
-static int    create_tree(TNODE*, unsigned short const*symv, MEMREF const*strv, int nstrs);
+static int    create_tree(TNODE*, unsigned short const*symv, MEMREF const*strv, int nstrs, DUPS*);
+static int    set_match(TNODE*, unsigned strno, DUPS*);
+static int    fill_groups(ACISM*, DUPS*, int nstrs);
+static PATTS* parse_patts(MEMREF const*strv, int nstrs);
+static void   free_patts(PATTS*);
+static int    fill_symv_patts(ACISM*, PATTS*, int nstrs);
+static size_t count_nodes(PATTS const*, int nstrs);
+static int    create_tree_patts(TNODE*, unsigned short const*symv, PATTS const*, int nstrs, DUPS*);
 static void add_backlinks(TNODE *troot, TNODE **v1, TNODE **v2);
-static int    interleave(TNODE*, int nnodes, int nsyms, TNODE**, TNODE**);
+static int    interleave(TNODE*, int nnodes, int nsyms, TNODE**, TNODE**, int by_heat);
+static int    fill_tables(ACISM*, TNODE*, int nnodes, int nhash, int nstrs);
+static int    train(ACISM*, TNODE*, int nnodes, MEMREF const*samplev, int nsamples);
 
 static TNODE* find_child(TNODE*, unsigned short);
 static void fill_tranv(ACISM *psp, TNODE const*tp);
-static void fill_hashv(ACISM *psp, TNODE const treev[], int nnodes);
+static int  fill_hashv(ACISM *psp, TNODE const treev[], int nnodes);
 
 // (ns) is either a STATE, or a (STRNO + tran_size)
 static inline void
@@ -49,22 +80,54 @@ void acism_destroy(ACISM *psp)
   if (!psp) return;
 
   free(psp->tranv);
+  free(psp->groupv);
   free(psp);
 }
 
-ACISM* acism_create(MEMREF const* strv, int nstrs)
+ACISM* acism_create(MEMREF const* strv, int nstrs, unsigned flags,
+                    MEMREF const *samplev, int nsamples)
 {
-  TNODE **v1 = NULL, **v2 = NULL;
+  TNODE **v1 = NULL, **v2 = NULL, *troot = NULL;
   ACISM *psp = static_cast<ACISM*>(calloc(1, sizeof*psp));
+  PATTS *pp = NULL;
+  DUPS  dups = { NULL, 0, 0 };
+  int nnodes = 0;
 
-  fill_symv(psp, strv, nstrs);
-  TNODE *troot = static_cast<TNODE*>(calloc(psp->nchars + 1, sizeof*troot));
+  if (!psp)
+    return psp;
 
-  int nnodes = create_tree(troot, psp->symv, strv, nstrs);
+  psp->flags = flags;
+  if (flags & ACISM_PATTERN) {
+    // Classes become single trie edges over byte equivalence classes,
+    //  so "[0-9][0-9]" costs two nodes, not a hundred leaves.
+    pp = parse_patts(strv, nstrs);
+    size_t maxnodes = pp && !fill_symv_patts(psp, pp, nstrs) ? count_nodes(pp, nstrs) : ~(size_t)0;
+    if (maxnodes < MAX_TRIE_BYTES / sizeof*troot)
+      troot = static_cast<TNODE*>(calloc(maxnodes + 1, sizeof*troot));
+    if (troot)
+      nnodes = create_tree_patts(troot, psp->symv, pp, nstrs, &dups);
+  } else {
+    fill_symv(psp, strv, nstrs);
+    troot = static_cast<TNODE*>(calloc(psp->nchars + 1, sizeof*troot));
+    if (troot)
+      nnodes = create_tree(troot, psp->symv, strv, nstrs, &dups);
+  }
+  if (nnodes < 0)
+    free(troot), troot = NULL;
 
   // v1, v2: breadth-first work vectors for add_backlink and interleave.
-  int i = (nstrs + 1) * sizeof(TNODE);
-  add_backlinks(troot, v1 = (TNODE**)malloc(i), v2 = (TNODE**)malloc(i));
+  //  A level of the trie never holds more than nnodes nodes.
+  size_t vsize = ((size_t)nnodes + 1) * sizeof(TNODE*);
+  if (troot) {
+    v1 = static_cast<TNODE**>(malloc(vsize));
+    v2 = static_cast<TNODE**>(malloc(vsize));
+  }
+  if (!v1 || !v2) {
+    free(troot), free(v1), free(v2), free(dups.v), free_patts(pp);
+    acism_destroy(psp), psp = NULL;
+    return psp;
+  }
+  add_backlinks(troot, v1, v2);
 
   int     nhash = 0;
   TNODE*  tp = troot + nnodes;
@@ -72,13 +135,44 @@ ACISM* acism_create(MEMREF const* strv, int nstrs)
     nhash += tp->match && tp->child;
 
   // Calculate each node's offset in tranv[]:
-  psp->tran_size = interleave(troot, nnodes, psp->nsyms, v1, v2);
+  psp->tran_size = interleave(troot, nnodes, psp->nsyms, v1, v2, 0);
 
-  if (bitwid(psp->tran_size + nstrs - 1) + SYM_BITS > sizeof(unsigned)*8 - 2) {
+  psp->nstrs = nstrs;
+  int err = fill_groups(psp, &dups, nstrs) || !psp->tran_size
+         || fill_tables(psp, troot, nnodes, nhash, nstrs);
+
+  if (!err && nsamples > 0) {
+    // Training: count state visits on the samples, then lay out again.
+    err = train(psp, troot, nnodes, samplev, nsamples)
+       || !(psp->tran_size = interleave(troot, nnodes, psp->nsyms, v1, v2, 1))
+       || fill_tables(psp, troot, nnodes, nhash, nstrs);
+  }
+
+  if (err) {
+    free(troot), free(v1), free(v2), free_patts(pp);
     acism_destroy(psp), psp = NULL;
     return psp;
   }
 
+  // Diagnostics/statistics only:
+  int i;
+  for (i = psp->maxlen = 0; i < nstrs; ++i) {
+    unsigned len = pp ? pp->startv[i+1] - pp->startv[i] : strv[i].len;
+    if (psp->maxlen < len) psp->maxlen = len;
+  }
+
+  free(troot), free(v1), free(v2), free_patts(pp);
+  return psp;
+}
+
+// Allocate and fill tranv[] and hashv[] from the trie as laid out by interleave().
+static int fill_tables(ACISM *psp, TNODE *troot, int nnodes, int nhash, int nstrs)
+{
+  if (bitwid(psp->tran_size + nstrs + psp->ngroups - 1) + SYM_BITS > sizeof(unsigned)*8 - 2)
+    return -1;
+
+  free(psp->tranv);
+  psp->hash_mod = psp->hash_size = 0;
   if (nhash) {
     // Hash table is for match info of non-leaf nodes (only).
     // Set hash_size for p_size(psp):
@@ -87,32 +181,61 @@ ACISM* acism_create(MEMREF const* strv, int nstrs)
     psp->hash_size = psp->hash_mod + nhash;
   }
   set_tranv(psp, calloc(p_size(psp), 1));
-  if (!psp->tranv) {
-    acism_destroy(psp), psp = NULL;
-    return psp;
-  }
+  if (!psp->tranv)
+    return -1;
   fill_tranv(psp, troot);
   // The root state (0) must not look like a valid backref.
   // Any symbol value other than (0) in tranv[0] ensures that.
   psp->tranv[0] = 1;
 
   if (nhash) {
-    fill_hashv(psp, troot, nnodes);
+    if (fill_hashv(psp, troot, nnodes))
+      return -1;
     // Adjust hash_size to include trailing overflows
     //  but trim trailing empty slots.
     psp->hash_size = psp->hash_mod;
     while ( psp->hashv[psp->hash_size].state)     ++psp->hash_size;
     while (!psp->hashv[psp->hash_size - 1].state) --psp->hash_size;
-    set_tranv(psp, realloc(psp->tranv, p_size(psp)));   // 节省内存
+    void *mem = realloc(psp->tranv, p_size(psp));   // 节省内存
+    if (mem) set_tranv(psp, mem);
   }
+  return 0;
+}
 
-  // Diagnostics/statistics only:
-  psp->nstrs = nstrs;
-  for (i = psp->maxlen = 0; i < nstrs; ++i)
-    if (psp->maxlen < strv[i].len) psp->maxlen = strv[i].len;
+static int no_action(int strnum, int textpos, void *context)
+{ (void)strnum, (void)textpos, (void)context; return 0; }
 
-  free(troot), free(v1), free(v2);
-  return psp;
+// Scan the samples one byte at a time, counting how often each state is
+//  entered, and hand the counts to the trie nodes for interleave(..., 1).
+// States passed through on the backref chain are counted too: their rows
+//  are read just like the entered state's. (The suffix-chain walk that
+//  reports matches is not; it only runs on a hit.)
+static int train(ACISM *psp, TNODE *troot, int nnodes, MEMREF const *samplev, int nsamples)
+{
+  unsigned *heatv = static_cast<unsigned*>(calloc(psp->tran_size, sizeof*heatv));
+
+  if (!heatv)
+    return -1;
+  for (int i = 0; i < nsamples; ++i) {
+    int state = 0;
+    for (size_t j = 0; j < samplev[i].len; ++j) {
+      MEMREF one = {samplev[i].ptr + j, 1};
+      unsigned s = state, sym = psp->symv[(uint8_t)*one.ptr];
+      while (sym && s != ROOT && !t_valid(psp, p_tran(psp, s, sym))) {
+        unsigned back = p_tran(psp, s, BACK);
+        s = t_valid(psp, back) ? t_next(psp, back) : ROOT;
+        if (heatv[s] < ~0u) ++heatv[s];
+      }
+      (void)acism_more(psp, one, no_action, NULL, &state);
+      if (heatv[state] < ~0u) ++heatv[state];
+    }
+  }
+
+  for (TNODE *tp = troot; tp < troot + nnodes; ++tp)
+    tp->heat = tp->child ? heatv[tp->state] : 0;
+  troot->heat = ~0u;  // ROOT must stay at state 0.
+  free(heatv);
+  return 0;
 }
 
 typedef struct { int freq; int rank; } FRANK;
@@ -140,7 +263,7 @@ static void fill_symv(ACISM *psp, MEMREF const *strv, int nstrs)
   psp->sym_mask = ~(~0 << psp->sym_bits);
 }
 
-static int create_tree(TNODE *Tree, unsigned short const *symv, MEMREF const *strv, int nstrs)
+static int create_tree(TNODE *Tree, unsigned short const *symv, MEMREF const *strv, int nstrs, DUPS *dp)
 {
   int i, j;
   TNODE *nextp = Tree + 1;
@@ -176,8 +299,278 @@ static int create_tree(TNODE *Tree, unsigned short const *symv, MEMREF const *st
       tp->sym = symv[(uint8_t)strv[i].ptr[j]];
       tp->back = Tree;
     }
-    tp->match = i + 1; // Encode strno as nonzero
+    if (set_match(tp, i, dp))
+      return -1;
+  }
+  return nextp - Tree;
+}
+
+static int set_match(TNODE *tp, unsigned strno, DUPS *dp)
+{
+  if (!tp->match) {
+    tp->match = strno + 1; // Encode strno as nonzero
+    return 0;
+  }
+
+  // Another pattern already ends here; fill_groups reports both.
+  if (dp->n == dp->cap) {
+    DUP *v = static_cast<DUP*>(realloc(dp->v, (dp->cap*2 + 16) * sizeof*v));
+    if (!v)
+      return -1;
+    dp->v = v, dp->cap = dp->cap*2 + 16;
+  }
+  dp->v[dp->n++] = (DUP){tp, strno};
+  return 0;
+}
+
+// Give every node in (dp) a group strno listing all its patterns.
+static int fill_groups(ACISM *psp, DUPS *dp, int nstrs)
+{
+  unsigned i, g, pos;
+
+  if (!dp->n)
+    return 0;
+
+  std::stable_sort(dp->v, dp->v + dp->n, [](DUP const &a, DUP const &b) { return a.node < b.node; });
+  for (i = psp->ngroups = 0; i < dp->n; ++i)
+    psp->ngroups += !i || dp->v[i].node != dp->v[i-1].node;
+
+  // groupv: ngroups+1 offsets, then each group's first pattern and its dups.
+  psp->groupv = static_cast<unsigned*>(malloc((2*psp->ngroups + 1 + dp->n) * sizeof*psp->groupv));
+  if (!psp->groupv) {
+    free(dp->v);
+    return -1;
+  }
+  for (i = g = 0, pos = psp->ngroups + 1; i < dp->n; ++i) {
+    TNODE *tp = dp->v[i].node;
+    if (!i || tp != dp->v[i-1].node) {
+      psp->groupv[g] = pos;
+      psp->groupv[pos++] = tp->match - 1;
+      tp->match = nstrs + g++ + 1;
+    }
+    psp->groupv[pos++] = dp->v[i].strno;
+  }
+  psp->groupv[g] = pos;
+  free(dp->v);
+  return 0;
+}
+
+static inline void set_bit(BYTESET *sp, unsigned b) { sp->bits[b >> 5] |= 1u << (b & 31); }
+static inline int  has_bit(BYTESET const *sp, unsigned b) { return sp->bits[b >> 5] >> (b & 31) & 1; }
+
+// Parse "[...]" starting after the '['. Returns the end of the class,
+//  or NULL if there is no closing ']' (the '[' is then a literal).
+static char const* parse_class(char const *cp, char const *endp, BYTESET *sp)
+{
+  int negate = cp < endp && *cp == '^';
+  char const *first = cp += negate;
+
+  memset(sp, 0, sizeof*sp);
+  for (; cp < endp && (*cp != ']' || cp == first); ++cp) {
+    if (*cp == '\\' && cp + 1 < endp) ++cp;
+    unsigned lo = (uint8_t)*cp, hi = lo;
+    if (cp + 2 < endp && cp[1] == '-' && cp[2] != ']') {
+      cp += 2;
+      if (*cp == '\\' && cp + 1 < endp) ++cp;
+      hi = (uint8_t)*cp;
+    }
+    for (; lo <= hi; ++lo) set_bit(sp, lo);
+  }
+  if (cp == endp) return NULL;
+
+  if (negate)
+    for (int i = 0; i < 8; ++i) sp->bits[i] = ~sp->bits[i];
+  return cp + 1;
+}
+
+static PATTS* parse_patts(MEMREF const *strv, int nstrs)
+{
+  PATTS *pp = static_cast<PATTS*>(calloc(1, sizeof*pp));
+  unsigned i, natoms = 0, setcap = 0;
+
+  if (!pp)
+    return pp;
+  // No pattern has more atoms than bytes.
+  for (i = 0; i < (unsigned)nstrs; ++i) natoms += strv[i].len;
+  pp->atomv = static_cast<unsigned*>(malloc((natoms + 1) * sizeof*pp->atomv));
+  pp->startv = static_cast<unsigned*>(malloc((nstrs + 1) * sizeof*pp->startv));
+  if (!pp->atomv || !pp->startv) {
+    free_patts(pp);
+    return NULL;
+  }
+
+  for (natoms = i = 0; i < (unsigned)nstrs; ++i) {
+    char const *cp = strv[i].ptr, *endp = cp + strv[i].len, *ep;
+    pp->startv[i] = natoms;
+
+    while (cp < endp) {
+      BYTESET set;
+      if (*cp == '?') {
+        memset(&set, 0xFF, sizeof set), ++cp;
+      } else if (*cp == '[' && (ep = parse_class(cp + 1, endp, &set))) {
+        cp = ep;
+      } else {
+        if (*cp == '\\' && cp + 1 < endp) ++cp;
+        pp->atomv[natoms++] = (uint8_t)*cp++;
+        continue;
+      }
+
+      // Patterns tend to reuse a handful of classes; share them.
+      unsigned k;
+      for (k = 0; k < pp->nsets && memcmp(&pp->setv[k], &set, sizeof set); ++k);
+      if (k == pp->nsets) {
+        if (pp->nsets == setcap) {
+          BYTESET *setv = static_cast<BYTESET*>(realloc(pp->setv, (setcap*2 + 8) * sizeof set));
+          if (!setv) {
+            free_patts(pp);
+            return NULL;
+          }
+          pp->setv = setv, setcap = setcap*2 + 8;
+        }
+        pp->setv[pp->nsets++] = set;
+      }
+      pp->atomv[natoms++] = 256 + k;
+    }
   }
+  pp->startv[nstrs] = natoms;
+  return pp;
+}
+
+static void free_patts(PATTS *pp)
+{
+  if (!pp) return;
+  free(pp->atomv), free(pp->startv), free(pp->setv);
+  free(pp->symsv), free(pp->symp), free(pp);
+}
+
+// Split bytes into equivalence classes: two bytes share a sym iff every
+//  atom (literal or class) either contains both or neither.
+//  Bytes in no atom at all keep sym 0, exactly as in fill_symv.
+static int fill_symv_patts(ACISM *psp, PATTS *pp, int nstrs)
+{
+  unsigned i, k, b, nparts = 1, nused = 0;
+  unsigned *usev = static_cast<unsigned*>(calloc(256 + pp->nsets, sizeof*usev));
+  unsigned char part[256] = { 0 };
+  FRANK frv[256];
+
+  if (!usev)
+    return -1;
+
+  psp->nchars = pp->startv[nstrs];
+  for (i = 0; i < psp->nchars; ++i) usev[pp->atomv[i]]++;
+
+  BYTESET cover = { { 0 } };
+  for (k = 0; k < 256 + pp->nsets; ++k) {
+    if (!usev[k]) continue;
+    BYTESET one = { { 0 } }, *sp = k < 256 ? &one : &pp->setv[k - 256];
+    if (k < 256) set_bit(&one, k);
+
+    // Refine every current partition by membership in (sp).
+    short remap[256][2];
+    memset(remap, -1, sizeof remap);
+    for (nparts = b = 0; b < 256; ++b) {
+      short *rp = &remap[part[b]][has_bit(sp, b)];
+      if (*rp < 0) *rp = nparts++;
+      part[b] = *rp;
+    }
+    for (i = 0; i < 8; ++i) cover.bits[i] |= sp->bits[i];
+  }
+
+  // Rank partitions by how many atoms use them, as fill_symv ranks bytes.
+  for (i = 0; i < 256; ++i) frv[i] = (FRANK){0, (int)i};
+  for (k = 0; k < 256 + pp->nsets; ++k) {
+    if (!usev[k]) continue;
+    char seen[256] = { 0 };
+    for (b = 0; b < 256; ++b)
+      if ((k < 256 ? b == k : has_bit(&pp->setv[k - 256], b)) && !seen[part[b]]++)
+        frv[part[b]].freq += usev[k];
+  }
+  qsort(frv, 256, sizeof*frv, (qsort_cmp)frcmp);
+
+  unsigned short partsym[256] = { 0 };
+  for (int r = 256; --r >= 0 && frv[r].freq;)
+    partsym[frv[r].rank] = ++nused;
+  psp->nsyms = nused + 1;
+  for (b = 0; b < 256; ++b)
+    psp->symv[b] = has_bit(&cover, b) ? partsym[part[b]] : 0;
+
+  psp->sym_bits = bitwid(psp->nsyms);
+  psp->sym_mask = ~(~0u << psp->sym_bits);
+
+  // Each class expands to the (distinct, ascending) syms of its bytes.
+  pp->symp = static_cast<unsigned*>(malloc((pp->nsets + 1) * sizeof*pp->symp));
+  pp->symsv = static_cast<unsigned short*>(malloc((pp->nsets * nused + 1) * sizeof*pp->symsv));
+  if (!pp->symp || !pp->symsv) {
+    free(usev);
+    return -1;
+  }
+  for (k = pp->symp[0] = 0; k < pp->nsets; ++k) {
+    char seen[257] = { 0 };
+    for (b = 0; b < 256; ++b)
+      if (has_bit(&pp->setv[k], b)) seen[psp->symv[b]] = 1;
+    pp->symp[k+1] = pp->symp[k];
+    for (i = 1; i <= nused; ++i)
+      if (seen[i]) pp->symsv[pp->symp[k+1]++] = i;
+  }
+  free(usev);
+  return 0;
+}
+
+// Upper bound on trie nodes: every prefix of every expansion.
+static size_t count_nodes(PATTS const *pp, int nstrs)
+{
+  size_t total = 0;
+  for (int i = 0; i < nstrs; ++i) {
+    size_t width = 1;
+    for (unsigned j = pp->startv[i]; j < pp->startv[i+1]; ++j) {
+      unsigned a = pp->atomv[j];
+      width *= a < 256 ? 1 : pp->symp[a - 255] - pp->symp[a - 256];
+      if ((total += width) >= MAX_TRIE_BYTES / sizeof(TNODE)) return total;
+    }
+  }
+  return total;
+}
+
+// Find or insert (tp)'s child for (sym), keeping siblings in sym order.
+static TNODE* add_child(TNODE *Tree, TNODE *tp, unsigned short sym, TNODE **nextpp)
+{
+  TNODE **cpp = &tp->child;
+  while (*cpp && (*cpp)->sym < sym) cpp = &(*cpp)->next;
+  if (*cpp && (*cpp)->sym == sym) return *cpp;
+
+  TNODE *np = (*nextpp)++;
+  np->sym = sym;
+  np->back = Tree;
+  np->next = *cpp;
+  return *cpp = np;
+}
+
+static int expand(TNODE *Tree, TNODE *tp, unsigned short const *symv, PATTS const *pp,
+                  unsigned const *ap, unsigned const *endp, unsigned strno,
+                  TNODE **nextpp, DUPS *dp)
+{
+  for (; ap < endp && *ap < 256; ++ap)
+    tp = add_child(Tree, tp, symv[*ap], nextpp);
+  if (ap == endp)
+    return set_match(tp, strno, dp);
+
+  unsigned k = *ap - 256;
+  for (unsigned j = pp->symp[k]; j < pp->symp[k+1]; ++j)
+    if (expand(Tree, add_child(Tree, tp, pp->symsv[j], nextpp), symv, pp, ap + 1, endp,
+               strno, nextpp, dp))
+      return -1;
+  return 0;
+}
+
+static int create_tree_patts(TNODE *Tree, unsigned short const *symv, PATTS const *pp,
+                             int nstrs, DUPS *dp)
+{
+  TNODE *nextp = Tree + 1;
+
+  for (int i = 0; i < nstrs; ++i)
+    if (expand(Tree, Tree, symv, pp, pp->atomv + pp->startv[i], pp->atomv + pp->startv[i+1],
+               i, &nextp, dp))
+      return -1;
   return nextp - Tree;
 }
 
@@ -195,7 +588,7 @@ static void add_backlinks(TNODE *troot, TNODE **v1, TNODE **v2)
 
     while ((srcp = *spp++)) {
       for (dstp = srcp->child; dstp; dstp = dstp->next) {
-        TNODE *bp = NULL;
+        TNODE *bp = NULL, *sp = NULL;
         if (dstp->child)
           *dpp++ = dstp;
 
@@ -207,16 +600,26 @@ static void add_backlinks(TNODE *troot, TNODE **v1, TNODE **v2)
         //  for the child (dstp).
         // Note that backlinks do not point at the suffix match;
         //  they point at the PARENT of that match.
-
-        for (tp = srcp->back; tp; tp = tp->back)
-          if ((bp = find_child(tp, dstp->sym)))
-            break;
+        // A leaf has no state to resume from, so a non-leaf (dstp)
+        //  skips leaf suffixes; (sp) keeps the longest suffix for is_suffix.
+        //  E.g. patterns "abcd" "bc" "ce": "abc" must fall back to "c", not
+        //  to the leaf "bc", or "ce" is missed in "abce" (see CMakeLists.txt).
+
+        for (tp = srcp->back; tp; tp = tp->back) {
+          if ((bp = find_child(tp, dstp->sym))) {
+            if (!sp) sp = bp;
+            if (bp->child || !dstp->child) break;
+            bp = NULL;
+          }
+        }
         if (!bp)
           bp = troot;
+        if (!sp)
+          sp = troot;
 
         dstp->back = dstp->child ? bp : tp ? tp : troot;
         dstp->back->nrefs++;
-        dstp->is_suffix = bp->match || bp->is_suffix;
+        dstp->is_suffix = sp->match || sp->is_suffix;
       }
     }
     *dpp = 0;
@@ -231,13 +634,20 @@ static TNODE * find_child(TNODE *tp, unsigned short sym)
   return tp && tp->sym == sym ? tp : NULL;
 }
 
+// Returns tran_size, or 0 if out of memory.
 static int
-interleave(TNODE *troot, int nnodes, int nsyms, TNODE **v1, TNODE **v2)
+interleave(TNODE *troot, int nnodes, int nsyms, TNODE **v1, TNODE **v2, int by_heat)
 {
   unsigned usev_size = nnodes + nsyms;
   char *usev = static_cast<char*>(calloc(usev_size, sizeof*usev));
-  unsigned last_trans = 0, startv[257][2] = { 0 };
-  TNODE *cp, **tmp;
+  unsigned last_trans = 0, last_base = 0, startv[257][2] = { 0 };
+  TNODE *cp, **tmp, *tp;
+  TNODE **nodev = static_cast<TNODE**>(malloc((nnodes + 1) * sizeof*nodev)), **endp = nodev;
+
+  if (!usev || !nodev) {
+    free(usev), free(nodev);
+    return 0;
+  }
 
   memset(startv, 0, nsyms * sizeof*startv);
 
@@ -245,59 +655,78 @@ interleave(TNODE *troot, int nnodes, int nsyms, TNODE **v1, TNODE **v2)
   //  That srsly improves locality (L1-cache use).
   v1[0] = troot, v1[1] = NULL;
   for (; *v1; tmp = v1, v1 = v2, v2 = tmp) {
-    TNODE **srcp = v1, **dstp = v2, *tp;
+    TNODE **srcp = v1, **dstp = v2;
     while ((tp = *srcp++)) {
       if (!tp->child) continue;
+      *endp++ = tp;
+      for (cp = tp->child; cp; cp = cp->next)
+        *dstp++ = cp;
+    }
+    *dstp = NULL;
+  }
 
-      if (tp->back == troot) tp->back = NULL; // simplify tests.
-      cp = tp->child;
+  // After training, place states by how often the samples entered them:
+  //  hot states (and so their hot children) share the first cache lines
+  //  and pages of tranv[]; never-visited states keep level order at the end.
+  if (by_heat)
+    std::stable_sort(nodev, endp, [](TNODE const *a, TNODE const *b) { return a->heat > b->heat; });
+
+  for (TNODE **npp = nodev; npp < endp; ++npp) {
+    tp = *npp;
+    if (tp->back == troot) tp->back = NULL; // simplify tests.
+    cp = tp->child;
+
+    unsigned pos, *startp = &startv[cp->sym][!!tp->back];
+    while ((cp = cp->next)) {
+      unsigned *newp = &startv[cp->sym][!!tp->back];
+      if (*startp < *newp) startp = newp;
+    }
 
-      unsigned pos, *startp = &startv[cp->sym][!!tp->back];
-      while ((cp = cp->next)) {
-        unsigned *newp = &startv[cp->sym][!!tp->back];
-        if (*startp < *newp) startp = newp;
+    // If (tp) has a backref, we need a slot at offset 0
+    //  that is free as a base AND to be used (filled in).
+    char need = tp->back ? BASE|USED : BASE;
+    for (pos = *startp;; ++pos) {
+      if (usev[pos] & need) {
+        continue;
       }
 
-      // If (tp) has a backref, we need a slot at offset 0
-      //  that is free as a base AND to be used (filled in).
-      char need = tp->back ? BASE|USED : BASE;
-      for (pos = *startp;; ++pos) {
-        if (usev[pos] & need) {
-          continue;
-        }
-
-        for (cp = tp->child; cp; cp = cp->next) {
-          if (usev[pos + cp->sym] & USED) break;
-        }
-
-        // No child needs an in-use slot? We're done.
-        if (!cp) break;
+      for (cp = tp->child; cp; cp = cp->next) {
+        if (usev[pos + cp->sym] & USED) break;
       }
-      tp->state = pos;
-
-      // Mark node's base and children as used:
-      usev[pos] |= need;
-      unsigned last = 0; // Make compiler happy
-      int nkids = 0;
-      for (cp = tp->child; cp; *dstp++ = cp, cp = cp->next, ++nkids)
-        usev[last = pos + cp->sym] |= USED;
-
-      // This is a HEURISTIC for advancing search for other nodes
-      *startp += (pos - *startp) / nkids;
-
-      if (last_trans < last) {
-        last_trans = last;
-        if (last + nsyms >= usev_size) {
-          usev = static_cast<char*>(realloc(usev, usev_size << 1));
-          memset(usev + usev_size, 0, usev_size);
-          usev_size <<= 1;
+
+      // No child needs an in-use slot? We're done.
+      if (!cp) break;
+    }
+    tp->state = pos;
+    if (last_base < pos) last_base = pos;
+
+    // Mark node's base and children as used:
+    usev[pos] |= need;
+    unsigned last = 0; // Make compiler happy
+    int nkids = 0;
+    for (cp = tp->child; cp; cp = cp->next, ++nkids)
+      usev[last = pos + cp->sym] |= USED;
+
+    // This is a HEURISTIC for advancing search for other nodes
+    *startp += (pos - *startp) / nkids;
+
+    if (last_trans < last) {
+      last_trans = last;
+      if (last + nsyms >= usev_size) {
+        char *newv = static_cast<char*>(realloc(usev, usev_size << 1));
+        if (!newv) {
+          free(usev), free(nodev);
+          return 0;
         }
+        memset((usev = newv) + usev_size, 0, usev_size);
+        usev_size <<= 1;
       }
     }
-    *dstp = NULL;
   }
-  free(usev);
-  return last_trans + 1;
+  free(usev), free(nodev);
+  // acism_more reads (state + sym) for any sym of the text,
+  //  so every state needs a full row of nsyms slots.
+  return last_trans + 1 > last_base + nsyms ? last_trans + 1 : last_base + nsyms;
 }
 
 static void fill_tranv(ACISM *psp, TNODE const*tp)
@@ -316,11 +745,13 @@ static void fill_tranv(ACISM *psp, TNODE const*tp)
   }
 }
 
-static void fill_hashv(ACISM *psp, TNODE const treev[], int nnodes)
+static int fill_hashv(ACISM *psp, TNODE const treev[], int nnodes)
 {
   STRASH *sv = static_cast<STRASH*>(malloc(psp->hash_mod * sizeof*sv)), *sp = sv;
   int i;
 
+  if (!sv)
+    return -1;
   // First pass: insert without resolving collisions.
   for (i = 0; i < nnodes; ++i) {
     unsigned base = treev[i].state;
@@ -340,6 +771,7 @@ static void fill_hashv(ACISM *psp, TNODE const treev[], int nnodes)
   }
 
   free(sv);
+  return 0;
 }
 
 int
@@ -402,8 +834,15 @@ acism_more(ACISM const *psp, MEMREF const text,
             strno = psp->hashv[i].strno;
           }
 
-          if ((ret = cb(strno, cp - text.ptr, context)))
-            return *statep = state, ret;
+          // A group strno stands for every pattern ending at this node.
+          unsigned const *mp = &strno, *endm = mp + 1;
+          if (strno >= psp->nstrs) {
+            mp = psp->groupv + psp->groupv[strno - psp->nstrs];
+            endm = psp->groupv + psp->groupv[strno - psp->nstrs + 1];
+          }
+          for (; mp < endm; ++mp)
+            if ((ret = cb(*mp, cp - text.ptr, context)))
+              return *statep = state, ret;
         }
         // If the original match was a leaf, state was set to 0, to be set
         //  The first node in the backref chain with a forward transition
@@ -424,3 +863,73 @@ acism_more(ACISM const *psp, MEMREF const text,
 
   return *statep = state, ret;
 }
+
+struct acism_query {
+  ACISM_MODE mode;
+  int       k, count;
+  uint32_t *seenv;    // ACISM_DISTINCT: one bit per strno
+  unsigned *setv;     //  and the (at most k) strnos set by this scan
+};
+
+ACISM_QUERY* acism_query_create(ACISM const *psp, ACISM_MODE mode, int k)
+{
+  ACISM_QUERY *qp = static_cast<ACISM_QUERY*>(calloc(1, sizeof*qp));
+
+  if (!qp)
+    return qp;
+  qp->mode = mode;
+  qp->k = mode == ACISM_ANY ? 1 : k;
+  if (mode == ACISM_DISTINCT && k > 0) {
+    // (+1): never a zero-size request, so NULL always means out of memory.
+    qp->seenv = static_cast<uint32_t*>(calloc(psp->nstrs / 32 + 1, sizeof*qp->seenv));
+    qp->setv = static_cast<unsigned*>(malloc(((unsigned)k < psp->nstrs ? k : psp->nstrs + 1) * sizeof*qp->setv));
+    if (!qp->seenv || !qp->setv) {
+      acism_query_destroy(qp);
+      return NULL;
+    }
+  }
+  return qp;
+}
+
+void acism_query_destroy(ACISM_QUERY *qp)
+{
+  if (!qp) return;
+  free(qp->seenv), free(qp->setv), free(qp);
+}
+
+// A nonzero return makes acism_more stop at once.
+static int on_total(int strnum, int textpos, ACISM_QUERY *qp)
+{
+  (void)strnum, (void)textpos;
+  return ++qp->count >= qp->k;
+}
+
+static int on_distinct(int strnum, int textpos, ACISM_QUERY *qp)
+{
+  (void)textpos;
+  uint32_t *wp = &qp->seenv[strnum >> 5], bit = 1u << (strnum & 31);
+  if (*wp & bit) return 0;
+
+  *wp |= bit;
+  qp->setv[qp->count++] = strnum;
+  return qp->count >= qp->k;
+}
+
+int acism_query(ACISM const *psp, ACISM_QUERY *qp, MEMREF const text)
+{
+  int state = 0;
+
+  qp->count = 0;
+  if (qp->k <= 0)
+    return 0;
+
+  if (qp->mode == ACISM_DISTINCT) {
+    (void)acism_more(psp, text, (ACISM_ACTION*)on_distinct, qp, &state);
+    // Clear only the bits this scan set: O(k), not O(nstrs).
+    for (int i = 0; i < qp->count; ++i)
+      qp->seenv[qp->setv[i] >> 5] = 0;
+  } else {
+    (void)acism_more(psp, text, (ACISM_ACTION*)on_total, qp, &state);
+  }
+  return qp->count;
+}
@@ -32,12 +32,27 @@ struct acism {
   unsigned hash_size; // #(hashv): hash_mod plus the overflows past [hash_mod-1]
   unsigned tran_size; // #(tranv)
   unsigned nsyms, nchars, nstrs, maxlen;
+  // Patterns ending at the same trie node (duplicates, overlapping globs):
+  //  such a node's strno is (nstrs + g), and group g's strnos are
+  //  groupv[groupv[g]..groupv[g+1]).
+  unsigned ngroups;
+  unsigned *groupv;
   unsigned short symv[256];
 };
 
 typedef struct acism ACISM;
 
-ACISM* acism_create(MEMREF const *strv, int nstrs);
+// acism_create flags:
+enum {
+  // Patterns are byte-wise globs: '?' matches any byte, "[...]" a byte class
+  //  ("[^...]" negated, "a-z" ranges), '\' makes the next byte literal.
+  ACISM_PATTERN = 1
+};
+
+// With samples, the samples are scanned once and states are laid out
+//  hottest first (see interleave) for cache and TLB locality.
+ACISM* acism_create(MEMREF const *strv, int nstrs, unsigned flags = 0,
+                    MEMREF const *samplev = NULL, int nsamples = 0);
 void   acism_destroy(ACISM*);
 
 static inline void set_tranv(ACISM *psp, void *mem)
@@ -63,4 +78,22 @@ typedef int (ACISM_ACTION)(int strnum, int textpos, void *context);
 int acism_more(ACISM const*, MEMREF const text,
                ACISM_ACTION *fn, void *fndata, int *state);
 
+// Query modes: each stops scanning as soon as its answer is decided.
+typedef enum {
+  ACISM_ANY,       // any match
+  ACISM_TOTAL,     // at least k hits, overlapping repeats included
+  ACISM_DISTINCT   // at least k distinct patterns
+} ACISM_MODE;
+
+// Per-caller scan state (and, for ACISM_DISTINCT, the seen-set),
+//  so one ACISM can serve many threads.
+typedef struct acism_query ACISM_QUERY;
+
+ACISM_QUERY* acism_query_create(ACISM const*, ACISM_MODE, int k);
+void         acism_query_destroy(ACISM_QUERY*);
+
+// Scan (text) from ROOT; return the hits (or distinct patterns) counted,
+//  which reaches k (1 for ACISM_ANY) exactly when the answer is yes.
+int acism_query(ACISM const*, ACISM_QUERY*, MEMREF const text);
+
 #endif
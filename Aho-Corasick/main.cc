@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <fstream>
 #include <iostream>
+#include <thread>
+#include <unistd.h>
 #include "acism.h"
+#include "stats.h"
 
 static int actual = 0, details = 1;
 
@@ -13,39 +16,166 @@ static int on_match(int strnum, int textpos, MEMREF const *pattv)
   return 0;
 }
 
+// Read a whole file ("-": stdin) and split it into lines.
+static MEMREF* read_lines(char const *filename, MEMBUF *buf, int *nlines)
+{
+  *buf = chomp(read_file(filename));
+  if (!buf->ptr) {
+    die("cannot read %s:", filename);
+  }
+  return refsplit(buf->ptr, '\n', nlines);
+}
+
+static int on_count(int strnum, int textpos, int *nhits)
+{
+  (void)strnum, (void)textpos;
+  ++*nhits;
+  return 0;
+}
+
+// Scan linev once with (psp); returns the elapsed time.
+static double scan_time(ACISM const *psp, MEMREF const *linev, int nlines, int *nhits)
+{
+  double t = tick();
+  *nhits = 0;
+  for (int i = 0; i < nlines; ++i) {
+    int state = 0;
+    (void)acism_more(psp, linev[i], (ACISM_ACTION*)on_count, nhits, &state);
+  }
+  return tick() - t;
+}
+
+// Best-of-reps scan throughput of linev with each of pspv[0..n), n <= 2.
+//  Each rep times all of them, in alternating order,
+//  so warm-up does not favour whichever runs second.
+static void bench(char const *const namev[], ACISM *const pspv[], int n,
+                  MEMREF const *linev, int nlines, int reps)
+{
+  double bestv[2] = { 0, 0 };
+  int nhitv[2] = { 0, 0 };
+  size_t nbytes = 0;
+
+  for (int i = 0; i < nlines; ++i) nbytes += linev[i].len;
+  for (int r = 0; r < reps; ++r) {
+    for (int k = 0; k < n; ++k) {
+      int j = r & 1 ? n - 1 - k : k;
+      double t = scan_time(pspv[j], linev, nlines, &nhitv[j]);
+      if (!r || t < bestv[j]) bestv[j] = t;
+    }
+  }
+  for (int j = 0; j < n; ++j)
+    printf("%-8s tran_size %9u  %.3f secs  %8.1f MB/s  %d hits\n",
+           namev[j], pspv[j]->tran_size, bestv[j], nbytes / 1E6 / bestv[j], nhitv[j]);
+}
+
+static void usage(char const *prog)
+{
+  fprintf(stderr, "%s [-p] [-d] [-t sample_file] [-s topk | -b reps] [-j nthreads] pattern_file [count]\n"
+          "  print stdin lines with more than count pattern hits; e.g. %s patts 2\n"
+          "  -d           count distinct patterns, not hits\n"
+          "  -p           patterns are globs: ? any byte, [a-z0-9] [^...] byte classes\n"
+          "  -t file      lay out hot states first, as visited by the lines of file\n"
+          "  -s topk      report per-pattern hit statistics of stdin instead\n"
+          "  -j nthreads  scanning threads for -s (default: all cores)\n"
+          "  -b reps      benchmark scanning stdin; with -t, default vs trained layout\n",
+          prog, prog);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "%s pattern_file [count]\ne.g. %s patts 2\n", argv[0], argv[0]);
+  unsigned flags = 0;
+  int opt, topk = -1, reps = 0, distinct = 0, nthreads = std::thread::hardware_concurrency();
+  char const *sample_file = NULL;
+  while ((opt = getopt(argc, argv, "pdt:s:j:b:")) != -1) {
+    switch (opt) {
+    case 'd': distinct = 1; break;
+    case 'p': flags |= ACISM_PATTERN; break;
+    case 't': sample_file = optarg; break;
+    case 'b': reps = atoi(optarg); break;
+    case 's': topk = atoi(optarg); break;
+    case 'j': nthreads = atoi(optarg); break;
+    default:  usage(argv[0]); return 1;
+    }
+  }
+
+  int nargs = argc - optind;
+  if (nargs != 2 && !((topk >= 0 || reps > 0) && nargs == 1)) {
+    usage(argv[0]);
     return 1;
   }
 
-  int count = atoi(argv[2]);
+  int count = nargs > 1 ? atoi(argv[optind + 1]) : 0;
   if (count < 0 || count > 50) {
     fprintf(stderr, "count value is imappropriate: %d\n", count);
   }
-  MEMBUF patt = chomp(read_file(argv[1]));
+  MEMBUF patt = chomp(read_file(argv[optind]));
 
   if (!patt.ptr) {
-    die("cannot read %s", argv[1]);
+    die("cannot read %s", argv[optind]);
   }
 
   int npatts;
   MEMREF *pattv = refsplit(patt.ptr, '\n', &npatts);
 
-  ACISM *psp = acism_create(pattv, npatts);
+  MEMBUF sample = NILBUF;
+  MEMREF *samplev = NULL;
+  int nsamples = 0;
+  if (sample_file) {
+    samplev = read_lines(sample_file, &sample, &nsamples);
+  }
+
+  ACISM *psp = acism_create(pattv, npatts, flags, samplev, nsamples);
+  if (!psp) {
+    die("cannot compile %s: automaton too large", argv[optind]);
+  }
 
   details = 0;
 
+  if (reps > 0) {
+    MEMBUF text;
+    int nlines;
+    MEMREF *linev = read_lines("-", &text, &nlines);
+    char const *namev[2] = { "default", "trained" };
+    ACISM *pspv[2] = { psp, NULL };
+    if (nsamples) {
+      pspv[0] = acism_create(pattv, npatts, flags);
+      if (!pspv[0]) {
+        die("cannot compile %s: automaton too large", argv[optind]);
+      }
+      pspv[1] = psp;
+    }
+    bench(namev, pspv, nsamples ? 2 : 1, linev, nlines, reps);
+    if (nsamples) acism_destroy(pspv[0]);
+    free(linev);
+    buffree(text);
+    return 0;
+  }
+
+  if (topk >= 0) {
+    MEMBUF text;
+    int nlines;
+    MEMREF *linev = read_lines("-", &text, &nlines);
+    STATS *sp = stats_scan(psp, linev, nlines, nthreads);
+    stats_report(stdout, sp, pattv, topk);
+    stats_destroy(sp);
+    free(linev);
+    buffree(text);
+    return 0;
+  }
+
+  // Stop scanning a line as soon as it has count+1 hits.
+  ACISM_QUERY *qp = acism_query_create(psp, distinct ? ACISM_DISTINCT
+                                       : count ? ACISM_TOTAL : ACISM_ANY, count + 1);
+  if (!qp) {
+    die("cannot allocate query for %s:", argv[optind]);
+  }
   std::string line;
   while (std::getline(std::cin, line)) {
-    actual = 0;
-    int state = 0;
     MEMREF text = {line.c_str(), line.size()};
-    (void)acism_more(psp, text, (ACISM_ACTION*)on_match, pattv, &state);
-    if (actual > count) {
+    if (acism_query(psp, qp, text) > count) {
       printf("%s\n", line.c_str());
     }
   }
+  acism_query_destroy(qp);
 }
 
 int main_old(int argc, char *argv[])
@@ -0,0 +1,153 @@
+#include "stats.h"
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+enum { CACHE_LINE = 64 };
+
+// Cache-line aligned calloc, so no two shards ever share a line.
+static void* line_calloc(size_t size)
+{
+  void *p = NULL;
+  size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+  if (posix_memalign(&p, CACHE_LINE, size ? size : CACHE_LINE))
+    die("cannot allocate %zu bytes:", size);
+  return memset(p, 0, size);
+}
+
+STATS* stats_create(unsigned nstrs)
+{
+  STATS *sp = static_cast<STATS*>(line_calloc(sizeof*sp));
+  sp->hitv = static_cast<uint64_t*>(line_calloc(nstrs * sizeof*sp->hitv));
+  sp->repv = static_cast<uint64_t*>(line_calloc(nstrs * sizeof*sp->repv));
+  sp->bufv = static_cast<unsigned*>(line_calloc((sp->bufcap = 1024) * sizeof*sp->bufv));
+  sp->nstrs = nstrs;
+  return sp;
+}
+
+void stats_destroy(STATS *sp)
+{
+  if (!sp) return;
+  free(sp->hitv), free(sp->repv), free(sp->bufv);
+  free(sp);
+}
+
+void stats_merge(STATS *dst, STATS const *src)
+{
+  for (unsigned i = 0; i < dst->nstrs; ++i) {
+    dst->hitv[i]  += src->hitv[i];
+    dst->repv[i]  += src->repv[i];
+  }
+  dst->nlines     += src->nlines;
+  dst->nhit_lines += src->nhit_lines;
+  dst->nhits      += src->nhits;
+}
+
+static int on_hit(int strnum, int textpos, STATS *sp)
+{
+  (void)textpos;
+  ++sp->hitv[strnum];
+  if (sp->nbuf == sp->bufcap) {
+    unsigned *bufv = static_cast<unsigned*>(realloc(sp->bufv, (sp->bufcap *= 2) * sizeof*bufv));
+    if (!bufv)
+      die("cannot allocate %zu bytes:", sp->bufcap * sizeof*bufv);
+    sp->bufv = bufv;
+  }
+  sp->bufv[sp->nbuf++] = strnum;
+  return 0;
+}
+
+// Count repeats of a pattern within the line just scanned.
+// seenv[] is a 1024-bit filter that fits in L1; a filter hit is confirmed
+//  by a short search, so hitv[]/repv[] are the only large arrays touched.
+// Long lines would fill the filter; sorting is cheap relative to them.
+static void count_repeats(STATS *sp)
+{
+  unsigned *bufv = sp->bufv, n = sp->nbuf;
+  if (n > 64) {
+    std::sort(bufv, bufv + n);
+    for (unsigned j = 1; j < n; ++j)
+      if (bufv[j] == bufv[j-1]) ++sp->repv[bufv[j]];
+    return;
+  }
+
+  for (unsigned j = 0; j < n; ++j) {
+    unsigned h = (bufv[j] * 2654435761u) >> 22;
+    uint64_t bit = 1ULL << (h & 63);
+    if (!(sp->seenv[h >> 6] & bit))
+      sp->seenv[h >> 6] |= bit;
+    else if (std::find(bufv, bufv + j, bufv[j]) != bufv + j)
+      ++sp->repv[bufv[j]];
+  }
+  memset(sp->seenv, 0, sizeof sp->seenv);
+}
+
+static void scan_shard(ACISM const *psp, MEMREF const *linev, size_t nlines, STATS *sp)
+{
+  for (size_t i = 0; i < nlines; ++i) {
+    int state = 0;
+    sp->nbuf = 0;
+    (void)acism_more(psp, linev[i], (ACISM_ACTION*)on_hit, sp, &state);
+    if (!sp->nbuf) continue;
+
+    sp->nhits += sp->nbuf, ++sp->nhit_lines;
+    count_repeats(sp);
+  }
+  sp->nlines = nlines;
+}
+
+STATS* stats_scan(ACISM const *psp, MEMREF const *linev, size_t nlines, int nthreads)
+{
+  if (nthreads < 1) nthreads = 1;
+  if ((size_t)nthreads > nlines) nthreads = nlines ? nlines : 1;
+
+  std::vector<STATS*> shardv(nthreads);
+  std::vector<std::thread> threadv;
+  size_t chunk = (nlines + nthreads - 1) / nthreads, start = 0;
+
+  for (int t = 0; t < nthreads; ++t, start += chunk) {
+    shardv[t] = stats_create(psp->nstrs);
+    size_t n = start >= nlines ? 0 : std::min(chunk, nlines - start);
+    if (t == nthreads - 1)
+      scan_shard(psp, linev + start, n, shardv[t]);
+    else
+      threadv.emplace_back(scan_shard, psp, linev + start, n, shardv[t]);
+  }
+  for (auto &th : threadv)
+    th.join();
+
+  for (int t = 1; t < nthreads; ++t) {
+    stats_merge(shardv[0], shardv[t]);
+    stats_destroy(shardv[t]);
+  }
+  return shardv[0];
+}
+
+void stats_report(FILE *fp, STATS const *sp, MEMREF const *pattv, int topk)
+{
+  std::vector<unsigned> livev, deadv;
+  for (unsigned i = 0; i < sp->nstrs; ++i)
+    (sp->hitv[i] ? livev : deadv).push_back(i);
+
+  fprintf(fp, "lines %zu, matched lines %zu, hits %llu, patterns %u, matched patterns %zu\n",
+          sp->nlines, sp->nhit_lines, (unsigned long long)sp->nhits,
+          sp->nstrs, livev.size());
+
+  size_t k = std::min((size_t)(topk < 0 ? 0 : topk), livev.size());
+  std::partial_sort(livev.begin(), livev.begin() + k, livev.end(),
+                    [sp](unsigned a, unsigned b) {
+                      return sp->hitv[a] != sp->hitv[b] ? sp->hitv[a] > sp->hitv[b] : a < b; });
+
+  fprintf(fp, "top %zu patterns:\n%12s %10s %7s  pattern\n", k, "hits", "lines", "strno");
+  for (size_t i = 0; i < k; ++i) {
+    unsigned s = livev[i];
+    fprintf(fp, "%12llu %10llu %7u  '%.*s'\n",
+            (unsigned long long)sp->hitv[s], (unsigned long long)(sp->hitv[s] - sp->repv[s]),
+            s, (int)pattv[s].len, pattv[s].ptr);
+  }
+
+  fprintf(fp, "never matched patterns: %zu\n", deadv.size());
+  for (unsigned s : deadv)
+    fprintf(fp, "%7u  '%.*s'\n", s, (int)pattv[s].len, pattv[s].ptr);
+}
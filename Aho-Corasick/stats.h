@@ -0,0 +1,34 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+#include <stdint.h>
+#include "acism.h"
+
+// One shard per scanning thread: the scan path only writes its own shard,
+//  so there is no atomic or cache-line contention. Shards are merged at the end.
+// A hit only bumps hitv[] and appends to bufv[]. At end of line, repeats of a
+//  pattern within the line go to repv[], so its line count is hitv[] - repv[].
+struct stats {
+  uint64_t *hitv;     // [nstrs] total hits
+  uint64_t *repv;     // [nstrs] hits on a line the pattern already hit
+  unsigned *bufv;     // strnos hit on the current line
+  size_t   nbuf, bufcap;
+  uint64_t seenv[16]; // hashed strnos of the current line
+  unsigned nstrs;
+  size_t   nlines;    // lines scanned
+  size_t   nhit_lines;
+  uint64_t nhits;
+};
+
+typedef struct stats STATS;
+
+STATS*  stats_create(unsigned nstrs);
+void    stats_destroy(STATS*);
+void    stats_merge(STATS *dst, STATS const *src);
+
+// Scan linev[0..nlines) on nthreads threads, one shard each; return the merged counts.
+STATS*  stats_scan(ACISM const*, MEMREF const *linev, size_t nlines, int nthreads);
+
+// Print totals, the topk heaviest patterns and all never-matched patterns.
+void    stats_report(FILE*, STATS const*, MEMREF const *pattv, int topk);
+
+#endif /* _STATS_H_ */
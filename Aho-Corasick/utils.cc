@@ -66,14 +66,28 @@ MEMBUF read_file(const char *filename)
     return NILBUF;
   }
 
-  ret = membuf(s.st_size);
-  int nbytes = read(fd, ret.ptr, ret.len);
+  // Pipes report st_size == 0: keep reading (and growing) until EOF.
+  //  A regular file is read into exactly st_size bytes.
+  int sized = S_ISREG(s.st_mode) && s.st_size;
+  ret = membuf(sized ? s.st_size : 65536);
+  size_t len = 0;
+  ssize_t nbytes;
+  while ((nbytes = read(fd, ret.ptr + len, ret.len - len)) > 0) {
+    if ((len += nbytes) < ret.len) continue;
+    if (sized) break;
+    char *ptr = static_cast<char*>(realloc(ret.ptr, (ret.len << 1) + 1));
+    if (!ptr) {
+      nbytes = -1;
+      break;
+    }
+    ret.ptr = ptr, ret.len <<= 1;
+  }
   if (nbytes < 0) {
     if (fd >= 0) close(fd);
     buffree(ret);
     return NILBUF;
   }
-  ret.len = nbytes;
+  ret.len = len;
 
   close(fd);
   ret.ptr[ret.len] = 0;